@@ -0,0 +1,474 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "db.h"
+
+/* the build database is a log, to which every stored value is appended,
+   and an index: a hash table from the keys to their latest record.
+   the index can always be recreated from the log and a record that was not
+   completely written (e.g. because of a crash) is dropped from the log */
+#define RECMAGIC   UINT32_C(0x6f646572) /* "redo" */
+#define IDXMAGIC   UINT64_C(0x7864692e6f646572) /* "redo.idx" */
+#define IDXSLOTS   (1 << 21) /* power of 2 */
+#define IDXPROBES  4096
+#define IDXCHUNK   4096 /* slots read at once while compacting */
+#define COMPACTMIN (1 << 20) /* smaller logs are never compacted */
+#define SLOTOFF(I) ((off_t)sizeof(struct idxhdr) + (off_t)(I) * sizeof(struct slot))
+#define RECLEN(R)  ((off_t)sizeof(struct rec) + (R).klen + (R).vlen)
+
+struct rec {
+	uint32_t magic;
+	uint32_t klen; /* including the nul */
+	uint32_t vlen;
+	uint32_t pad;
+	uint64_t sum; /* of the key and the value */
+};
+
+struct idxhdr {
+	uint64_t magic;
+	uint64_t loglen; /* bytes of the log the index is up-to-date with */
+	uint64_t live; /* bytes of the records the index points to */
+};
+
+struct slot {
+	uint64_t hash;
+	uint64_t off; /* of the record in the log + 1, 0 for empty slots */
+};
+
+static struct {
+	char pth[PATH_MAX], idxpth[PATH_MAX], dir[PATH_MAX];
+	int fd, idxfd;
+	mode_t fmode;
+	int fsync;
+} db = { .fd = -1, .idxfd = -1 };
+
+intern int openfds(void);
+intern void closefds(void);
+intern int rdhdr(struct idxhdr *h);
+intern int wrhdr(const struct idxhdr *h);
+intern int rdrec(off_t off, off_t sz, struct rec *r, char **kv);
+intern long idxfind(const char *key, uint64_t h, struct slot *s, struct rec *r);
+intern int idxsync(off_t *sz);
+intern int dblock(int type, off_t *sz);
+intern void dbunlock(void);
+intern int compact(off_t sz);
+
+int
+openfds(void)
+{
+	if ((db.fd = open(db.pth, O_RDWR|O_CREAT|O_CLOEXEC, db.fmode)) < 0)
+		return -1;
+	if ((db.idxfd = open(db.idxpth, O_RDWR|O_CREAT|O_CLOEXEC, db.fmode)) < 0) {
+		close(db.fd);
+		db.fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+void
+closefds(void)
+{
+	close(db.fd);
+	close(db.idxfd);
+	db.fd = db.idxfd = -1;
+}
+
+int
+rdhdr(struct idxhdr *h)
+{
+	ssize_t r;
+
+	if ((r = dopread(db.idxfd, h, sizeof *h, 0)) < 0)
+		return -1;
+	if (r < sizeof *h) /* new index */
+		memset(h, 0, sizeof *h);
+	return 0;
+}
+
+int
+wrhdr(const struct idxhdr *h)
+{
+	return dopwrite(db.idxfd, h, sizeof *h, 0) < 0 ? -1 : 0;
+}
+
+/* read and verify the record at off in *r and its key and value in *kv,
+   which the caller frees
+   return 0 when the record is invalid */
+int
+rdrec(off_t off, off_t sz, struct rec *r, char **kv)
+{
+	ssize_t n;
+
+	*kv = NULL;
+	if ((n = dopread(db.fd, r, sizeof *r, off)) < 0)
+		return -1;
+	if (n < sizeof *r || r->magic != RECMAGIC || !r->klen ||
+	r->klen > PATH_MAX || RECLEN(*r) > sz - off)
+		return 0;
+	if (!(*kv = malloc(r->klen + r->vlen)))
+		return -1;
+	if ((n = dopread(db.fd, *kv, r->klen + r->vlen, off + sizeof *r)) < 0)
+		goto err;
+	if (n < r->klen + r->vlen || (*kv)[r->klen-1] ||
+	hash64(*kv, r->klen + r->vlen, HASHINIT) != r->sum) {
+		free(*kv);
+		*kv = NULL;
+		return 0;
+	}
+	return 1;
+err:
+	free(*kv);
+	*kv = NULL;
+	return -1;
+}
+
+/* find the slot of key, or the empty one it would take, in *s
+   and, when found, the header of its record in *r
+   return the index of the slot */
+long
+idxfind(const char *key, uint64_t h, struct slot *s, struct rec *r)
+{
+	size_t i, n, klen;
+	ssize_t rn;
+	char buf[sizeof *r + PATH_MAX];
+
+	klen = strlen(key) + 1;
+	for (i = h & (IDXSLOTS-1), n = 0; n < IDXPROBES;
+	i = (i+1) & (IDXSLOTS-1), n++) {
+		if ((rn = dopread(db.idxfd, s, sizeof *s, SLOTOFF(i))) < 0)
+			return -1;
+		if (rn < sizeof *s || !s->off) {
+			memset(s, 0, sizeof *s);
+			return i;
+		}
+		if (s->hash != h)
+			continue;
+		if ((rn = dopread(db.fd, buf, sizeof *r + klen, s->off - 1)) < 0)
+			return -1;
+		memcpy(r, buf, sizeof *r);
+		if (rn == sizeof *r + klen && r->klen == klen &&
+		!memcmp(buf + sizeof *r, key, klen))
+			return i;
+	}
+	errno = ENOSPC;
+	return -1;
+}
+
+/* bring the index up-to-date with the log, which is *sz bytes long,
+   recreating it if needed
+   the write lock must be held */
+int
+idxsync(off_t *sz)
+{
+	struct idxhdr hdr;
+	struct slot s;
+	struct rec r, or;
+	uint64_t h;
+	off_t off;
+	long i;
+	int ok;
+	char *kv;
+
+	if (rdhdr(&hdr) < 0)
+		return -1;
+	if (hdr.magic != IDXMAGIC || hdr.loglen > *sz) {
+		if (ftruncate(db.idxfd, 0) < 0 ||
+		ftruncate(db.idxfd, SLOTOFF(IDXSLOTS)) < 0)
+			return -1;
+		hdr = (struct idxhdr){ .magic = IDXMAGIC };
+	}
+	for (off = hdr.loglen; off < *sz; off += RECLEN(r)) {
+		if ((ok = rdrec(off, *sz, &r, &kv)) < 0)
+			return -1;
+		if (!ok) { /* drop what was partially written */
+			if (ftruncate(db.fd, off) < 0)
+				return -1;
+			*sz = off;
+			break;
+		}
+		h = hash64(kv, r.klen-1, HASHINIT);
+		i = idxfind(kv, h, &s, &or);
+		free(kv);
+		if (i < 0)
+			return -1;
+		if (s.off)
+			hdr.live -= RECLEN(or);
+		s.hash = h, s.off = off + 1;
+		hdr.live += RECLEN(r);
+		if (dopwrite(db.idxfd, &s, sizeof s, SLOTOFF(i)) < 0)
+			return -1;
+	}
+	if (db.fsync && fsync(db.idxfd) < 0)
+		return -1;
+	hdr.loglen = *sz;
+	return wrhdr(&hdr);
+}
+
+/* lock the database, reopening it if it got compacted in the meantime,
+   and make sure the index is up-to-date with the log,
+   which is *sz bytes long */
+int
+dblock(int type, off_t *sz)
+{
+	struct idxhdr hdr;
+	struct stat st;
+	int errnsv;
+
+	while (1) {
+		if (filelck(db.fd, F_SETLKW, type, 0, 0) < 0)
+			return -1;
+		if (fstat(db.fd, &st) < 0)
+			goto err;
+		if (st.st_nlink)
+			break;
+		closefds();
+		if (openfds() < 0)
+			return -1;
+	}
+	*sz = st.st_size;
+	if (rdhdr(&hdr) < 0)
+		goto err;
+	if (hdr.magic == IDXMAGIC && hdr.loglen == *sz)
+		return 0;
+	if (type == F_WRLCK) {
+		if (idxsync(sz) < 0)
+			goto err;
+		return 0;
+	}
+	dbunlock();
+	if (dblock(F_WRLCK, sz) < 0)
+		return -1;
+	if (filelck(db.fd, F_SETLK, F_RDLCK, 0, 0) < 0)
+		goto err;
+	return 0;
+err:
+	errnsv = errno;
+	dbunlock();
+	errno = errnsv;
+	return -1;
+}
+
+void
+dbunlock(void)
+{
+	filelck(db.fd, F_SETLK, F_UNLCK, 0, 0);
+}
+
+/* rewrite the log with only the latest records, and the index with them
+   at the same slots, then replace both
+   the write lock must be held */
+int
+compact(off_t sz)
+{
+	struct idxhdr hdr;
+	struct slot sv[IDXCHUNK];
+	struct rec r;
+	size_t i, j;
+	off_t off;
+	int fd, idxfd, ok, rv;
+	char *kv;
+	char tpth[PATH_MAX+2], tidxpth[PATH_MAX+2];
+
+	kv = NULL, idxfd = -1;
+	sprintf(tpth, "%s.t", db.pth);
+	sprintf(tidxpth, "%s.t", db.idxpth);
+	if ((fd = open(tpth, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, db.fmode)) < 0)
+		return -1;
+	if ((idxfd = open(tidxpth, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC,
+	db.fmode)) < 0 || ftruncate(idxfd, SLOTOFF(IDXSLOTS)) < 0)
+		RET(-1);
+
+	for (off = 0, i = 0; i < IDXSLOTS; i += IDXCHUNK) {
+		if (dopread(db.idxfd, sv, sizeof sv, SLOTOFF(i)) < 0)
+			RET(-1);
+		for (ok = 0, j = 0; j < IDXCHUNK; j++) {
+			if (!sv[j].off)
+				continue;
+			if ((rv = rdrec(sv[j].off - 1, sz, &r, &kv)) <= 0) {
+				if (!rv)
+					errno = EIO;
+				RET(-1);
+			}
+			if (dopwrite(fd, &r, sizeof r, off) < 0 ||
+			dopwrite(fd, kv, r.klen + r.vlen, off + sizeof r) < 0)
+				RET(-1);
+			free(kv);
+			kv = NULL;
+			sv[j].off = off + 1;
+			off += RECLEN(r);
+			ok = 1;
+		}
+		if (ok && dopwrite(idxfd, sv, sizeof sv, SLOTOFF(i)) < 0)
+			RET(-1);
+	}
+	hdr = (struct idxhdr){ .magic = IDXMAGIC, .loglen = off, .live = off };
+	if (dopwrite(idxfd, &hdr, sizeof hdr, 0) < 0)
+		RET(-1);
+	if (db.fsync && (fsync(fd) < 0 || fsync(idxfd) < 0))
+		RET(-1);
+	/* the index first: a new log with an old index gets its index recreated */
+	if (rename(tidxpth, db.idxpth) < 0 || rename(tpth, db.pth) < 0)
+		RET(-1);
+	if (db.fsync && dirsync(db.dir) < 0)
+		RET(-1);
+	closefds(); /* releases the lock too */
+	db.fd = fd, db.idxfd = idxfd;
+	return 0;
+befret:
+	free(kv);
+	close(fd);
+	if (idxfd >= 0)
+		close(idxfd);
+	return rv;
+}
+
+/* open the database in pth, which must be an absolute path, and compact it
+   if so requested and it is mostly made of overwritten records */
+int
+dbopen(const char *pth, mode_t fmode, FPARS(int, fsync, compct))
+{
+	struct idxhdr hdr;
+	off_t sz;
+	char *s;
+
+	if (snprintf(db.pth, sizeof db.pth, "%s", pth) >= sizeof db.pth - 2 ||
+	snprintf(db.idxpth, sizeof db.idxpth, "%s.idx", pth) >= sizeof db.idxpth - 2) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(db.dir, db.pth);
+	s = strrchr(db.dir, '/');
+	s[s == db.dir] = '\0';
+	db.fmode = fmode, db.fsync = fsync;
+	if (openfds() < 0)
+		return -1;
+	if (!compct)
+		return 0;
+
+	if (dblock(F_WRLCK, &sz) < 0)
+		return -1;
+	if (rdhdr(&hdr) < 0 ||
+	(sz > COMPACTMIN && sz > 2 * hdr.live && compact(sz) < 0)) {
+		dbunlock();
+		return -1;
+	}
+	dbunlock();
+	return 0;
+}
+
+/* get the latest value stored for key in *val, which the caller frees,
+   and its offset in the log in *off
+   return 0 if there is none */
+int
+dbget(const char *key, char **val, size_t *len, off_t *off)
+{
+	struct slot s;
+	struct rec r;
+	off_t sz;
+	ssize_t n;
+	int errnsv, rv;
+
+	*val = NULL;
+	if (dblock(F_RDLCK, &sz) < 0)
+		return -1;
+	if (idxfind(key, hash64(key, strlen(key), HASHINIT), &s, &r) < 0)
+		RET(-1);
+	if (!s.off)
+		RET(0);
+	if (!(*val = malloc(r.vlen ? r.vlen : 1)))
+		RET(-1);
+	if ((n = dopread(db.fd, *val, r.vlen, s.off - 1 + sizeof r + r.klen)) < 0)
+		RET(-1);
+	if (n < r.vlen) {
+		errno = EIO;
+		RET(-1);
+	}
+	*len = r.vlen;
+	*off = s.off - 1;
+	RET(1);
+befret:
+	errnsv = errno;
+	dbunlock();
+	if (rv < 0) {
+		free(*val);
+		*val = NULL;
+	}
+	errno = errnsv;
+	return rv;
+}
+
+/* append val as the latest value of key, unless exp is not DBANY and differs
+   from the offset of the current latest one (-1 for none)
+   set *off to its offset, when off is not NULL
+   return 0 if it was not appended */
+int
+dbput(const char *key, const void *val, size_t len, off_t exp, off_t *off)
+{
+	struct idxhdr hdr;
+	struct slot s;
+	struct rec r, or;
+	off_t sz;
+	long i;
+	int errnsv, rv;
+	char *buf;
+
+	buf = NULL;
+	if (dblock(F_WRLCK, &sz) < 0)
+		return -1;
+	r = (struct rec){
+		.magic = RECMAGIC,
+		.klen = strlen(key) + 1,
+		.vlen = len,
+	};
+	if ((i = idxfind(key, hash64(key, r.klen-1, HASHINIT), &s, &or)) < 0)
+		RET(-1);
+	if (exp != DBANY && exp != (s.off ? (off_t)s.off - 1 : -1))
+		RET(0);
+
+	if (!(buf = malloc(RECLEN(r))))
+		RET(-1);
+	memcpy(buf + sizeof r, key, r.klen);
+	memcpy(buf + sizeof r + r.klen, val, len);
+	r.sum = hash64(buf + sizeof r, r.klen + r.vlen, HASHINIT);
+	memcpy(buf, &r, sizeof r);
+	if (dopwrite(db.fd, buf, RECLEN(r), sz) < 0) {
+		errnsv = errno;
+		ftruncate(db.fd, sz);
+		errno = errnsv;
+		RET(-1);
+	}
+	if (db.fsync && fsync(db.fd) < 0)
+		RET(-1);
+
+	/* the slot is safely stored before the index covers the record */
+	if (rdhdr(&hdr) < 0)
+		RET(-1);
+	if (s.off)
+		hdr.live -= RECLEN(or);
+	s.hash = hash64(key, r.klen-1, HASHINIT), s.off = sz + 1;
+	if (dopwrite(db.idxfd, &s, sizeof s, SLOTOFF(i)) < 0 ||
+	(db.fsync && fsync(db.idxfd) < 0))
+		RET(-1);
+	hdr.live += RECLEN(r);
+	hdr.loglen = sz + RECLEN(r);
+	if (wrhdr(&hdr) < 0)
+		RET(-1);
+	if (off)
+		*off = sz;
+	RET(1);
+befret:
+	errnsv = errno;
+	free(buf);
+	dbunlock();
+	errno = errnsv;
+	return rv;
+}
@@ -0,0 +1,5 @@
+#define DBANY ((off_t)-2) /* for dbput: don't care what is replaced */
+
+int dbopen(const char *pth, mode_t fmode, FPARS(int, fsync, compact));
+int dbget(const char *key, char **val, size_t *len, off_t *off);
+int dbput(const char *key, const void *val, size_t len, off_t exp, off_t *off);
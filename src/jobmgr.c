@@ -4,6 +4,7 @@
 #include <string.h>
 #include <setjmp.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include "util.h"
 #include "jobmgr.h"
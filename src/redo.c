@@ -7,16 +7,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "util.h"
 #include "jobmgr.h"
+#include "db.h"
+#include "runtab.h"
+#include "statv.h"
 #include "arg.h"
 
 /* max number of chars added to valid paths as suffix */
 #define PTHMAXSUF  (sizeof redir + NAME_MAX)
+#define HCACHESZ   256 /* entries of the contents hashes cache, power of 2 */
+#define DCACHESZ   16  /* entries of the directories fds cache */
+#define BCACHESZ   4096 /* buckets of the server's build-info cache */
+#define STATBATCH  16  /* dependencies worth stating in parallel */
+#define BIVER      2   /* version of the build-info format written */
 #define TSEQ(A, B) ((A).tv_sec == (B).tv_sec && (A).tv_nsec == (B).tv_nsec)
 #define DIRFROMPATH(D, PATH, CODE)\
 	do {\
@@ -38,6 +49,9 @@ enum { DOFINT, DOFERR, TRGSAME, TRGNEW };
 /* possible outcomes of trying to acquire an exexution lock */
 enum { LCKERR, DEPCYCL, LCKREL, LCKACQ };
 
+/* how the memory of build info read is owned */
+enum { BIMALLOC, BIMMAP, BICACHE };
+
 typedef int redofnt(char *, int, int);
 
 struct dofile {
@@ -52,7 +66,78 @@ struct dep {
 	int type;
 	ino_t ino;
 	struct timespec mtim;
-	char fnm[PATH_MAX];
+	int hashed; /* whether size and hash of the contents are known */
+	off_t size;
+	uint64_t hash;
+	int refr; /* contents are the same, but ino and mtim got refreshed */
+	size_t stoff; /* offset of its ino and mtim (v1) or record (v2) in bi */
+	const char *fnm;
+};
+
+/* build info v2: a header, depc fixed-size records
+   and a string table, at stroff, of length-prefixed, '\0'-terminated paths
+   hdrsz and recsz let fields be appended without a new version
+   v1 was a sequence of: type, raw ino and mtim (but for '-'), path, '\0' */
+struct bihdr {
+	char magic[4];
+	uint16_t ver, hdrsz;
+	uint32_t depc;
+	uint16_t recsz, pad;
+	uint64_t stroff;
+};
+
+struct birec {
+	uint64_t ino;
+	int64_t sec, nsec;
+	int64_t size;
+	uint64_t hash;
+	uint32_t fnmoff; /* in the string table */
+	uint8_t type, hashed;
+	uint8_t pad[2];
+};
+
+struct bi { /* build info read in memory */
+	char *buf;
+	size_t len;
+	int mem;
+	int ver;
+	size_t off, end; /* of the next, and after the last, dependency */
+	size_t recsz, stroff;
+	/* what it was read from: */
+	ino_t ino; /* the build-info file */
+	struct timespec mtim;
+	off_t dboff; /* or the database's record */
+};
+
+struct bcent { /* build info the server keeps in memory */
+	struct bcent *next;
+	char *trg;
+	/* of the build-info file it was read from */
+	ino_t ino;
+	struct timespec mtim;
+	off_t size;
+	char *buf;
+	size_t len;
+};
+
+struct hcent { /* cached hash of a file's contents */
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtim;
+	off_t size;
+	uint64_t hash;
+};
+
+struct dcent { /* cached fd of an open directory */
+	char pth[PATH_MAX]; /* empty for unused entries */
+	int fd;
+	int refs;
+};
+
+struct depstv { /* status of dependencies, stated at once */
+	size_t n;
+	struct stat *stv;
+	int *errv;
 };
 
 struct {
@@ -62,6 +147,11 @@ struct {
 	int pdepfd; /* fd in which parents expects dependency reporting */
 	int retonsig; /* whether the signal handler should return instead of exiting */
 	int fsync;
+	int hash; /* record the hash of dependencies' contents */
+	int cutoff; /* keep $1 when the .do file recreated it as it was */
+	int db; /* build info is stored in the database */
+	unsigned long nexec; /* .do files executed by this instance */
+	int srv; /* this instance is a server: it checks but never builds */
 	char topwd[PATH_MAX];
 	char wd[PATH_MAX];
 	char tmpffmt[PATH_MAX];
@@ -74,7 +164,12 @@ struct {
 	const char *topwd, *toppid;
 	const char *pdepfd;
 	const char *jmrfd, *jmwfd;
+	const char *runfd;
 	const char *fsync;
+	const char *hash;
+	const char *cutoff;
+	const char *db;
+	const char *server;
 } enm = { /* environment variables names */
 	.lvl    = "_REDO_LEVEL",
 	.topwd  = "_REDO_TOPWD",
@@ -82,13 +177,25 @@ struct {
 	.pdepfd = "_REDO_DEPFD",
 	.jmrfd  = "_REDO_JMRFD",
 	.jmwfd  = "_REDO_JMWFD",
+	.runfd  = "_REDO_RUNFD",
 	.fsync  = "REDO_FSYNC",
+	.hash   = "REDO_HASH",
+	.cutoff = "REDO_CUTOFF",
+	.db     = "REDO_DB",
+	.server = "REDO_SERVER",
 };
 
 const char *prognm;
 const char shell[]      = "/bin/sh";
 const char shellflags[] = "-e";
 const char redir[]      = ".redo"; /* directory redo expects to use exclusively */
+const char bimagic[4]   = "rdbi";
+const char srvsock[]    = "server"; /* default socket of a server, in redir */
+
+struct hcent hcache[HCACHESZ];
+struct dcent dcache[DCACHESZ];
+struct bcent *bcache[BCACHESZ];
+volatile sig_atomic_t gotsig; /* a signal was caught and returned from */
 
 intern intmax_t strtoint(const char *str, FPARS(intmax_t, min, max, def));
 intern intmax_t envgeti(const char *nm, FPARS(intmax_t, min, max, def));
@@ -98,22 +205,35 @@ intern int envseti(const char *nm, intmax_t n);
 intern char *normpath(char *abs, size_t n, FPARS(const char, *path, *relto));
 intern char *relpath(char *rlp, size_t n, FPARS(const char, *path, *relto));
 intern int mkpath(char *path, mode_t mode);
-intern int filelck(FPARS(int, fd, cmd, type), FPARS(off_t, start, len));
-intern int dirsync(const char *dpth);
 intern int dofisok(const char *pth, int depfd);
 intern int finddof(const char *trg, struct dofile *df, int depfd);
+intern int samecont(const char *fnm, int fd);
 intern int execdof(struct dofile *fd, FPARS(int, lvl, depfd));
 intern char *redirentry(char *fnm, FPARS(const char, *trg, *suf));
 intern char *getlckfnm(char *fnm, const char *trg);
 intern char *getbifnm(char *fnm, const char *trg);
 intern int repdep(int depfd, char t, const char *trg);
-intern int fputdep(FILE *f, int t, FPARS(const char, *fnm, *trg));
-intern int recdeps(FPARS(const char, *bifnm, *rdfnm, *trg));
-intern int fgetdep(FILE *f, struct dep *dep);
-intern int depchanged(struct dep *dep, int tdirfd);
+intern int fputdep(struct birec *rec, FILE *sf, int t,
+	FPARS(const char, *fnm, *trg));
+intern int recdeps(FPARS(const char, *rdfnm, *trg));
+intern void biinit(struct bi *bi);
+intern void bifree(struct bi *bi);
+intern int readbi(struct bi *bi, const char *trg);
+intern int readbicache(struct bi *bi, const char *trg);
+intern int writebi(const char *trg, const char *buf, size_t len,
+	const struct bi *old);
+intern int bigetdep(struct bi *bi, struct dep *dep);
+intern void bisetst(struct bi *bi, const struct dep *dep);
+intern int fhash(int dirfd, const char *fnm, const struct stat *st, uint64_t *h);
+intern int bistatv(struct bi *bi, int tdirfd, struct depstv *ds);
+intern int depchanged(struct dep *dep, int tdirfd, const struct stat *pst,
+	int perr);
+intern int diropen(const char *dir);
+intern int dirclose(int fd);
 intern void pstatln(FPARS(int, ok, lvl), FPARS(const char, *trg, *dfpth));
 intern int acqexlck(int *fd, const char *lckfnm);
 intern int redo(char *trg, FPARS(int, lvl, pdepfd));
+intern int pifchange(struct bi *bi, const char *tdir, FPARS(int, lvl, *done));
 intern int redoifchange(char *trg, FPARS(int, lvl, pdepfd));
 intern int redoifcreate(char *trg, FPARS(int, lvl, pdepfd));
 intern int redoinfofor(char *trg, FPARS(int, lvl, pdepfd));
@@ -121,6 +241,11 @@ intern int fredo(redofnt *, char *targ);
 intern void jredo(redofnt *, char *trg, FPARS(int, *paral, hnext));
 intern void vredo(redofnt *, int trgc, char *trgv[]);
 intern void vjredo(redofnt *, int trgc, char *trgv[]);
+intern int srvaddr(struct sockaddr_un *sa, const char *wd, int *dflt);
+intern int srvhdr(char *hdr, size_t n, const char *wd);
+intern int srvask(int trgc, char *trgv[]);
+intern void srvconn(int fd, const char *hdr);
+intern void srvrun(void);
 intern void spawnjm(int jobsn);
 intern void onsig(int sig);
 intern void setup(int jobsn);
@@ -281,29 +406,6 @@ mkpath(char *path, mode_t mode)
 	return mkdir(path, mode);
 }
 
-int
-filelck(FPARS(int, fd, cmd, type), FPARS(off_t, start, len))
-{
-	struct flock fl = {
-		.l_type = type,
-		.l_whence = SEEK_SET,
-		.l_start = start,
-		.l_len = len,
-	};
-	return fcntl(fd, cmd, &fl);
-}
-
-int
-dirsync(const char *dpth)
-{
-	int dirfd;
-
-	if ((dirfd = open(dpth, O_RDONLY|O_DIRECTORY)) < 0 ||
-	fsync(dirfd) < 0 || close(dirfd) < 0)
-		return -1;
-	return 0;
-}
-
 int
 dofisok(const char *pth, int depfd)
 {
@@ -353,12 +455,38 @@ finddof(const char *trg, struct dofile *df, int depfd)
 #undef ckdof
 }
 
+/* whether the file fnm exists and has the same contents and mode as fd */
+int
+samecont(const char *fnm, int fd)
+{
+	struct stat st, fst;
+	int cfd, rv;
+
+	if ((cfd = open(fnm, O_RDONLY|O_CLOEXEC)) < 0) {
+		if (errno != ENOENT)
+			perrnand(return -1, "open: %s", fnm);
+		return 0;
+	}
+	if (fstat(cfd, &st) < 0 || fstat(fd, &fst) < 0)
+		perrnand(RET(-1), "fstat: %s", fnm);
+	if (!S_ISREG(st.st_mode) || st.st_mode != fst.st_mode ||
+	st.st_size != fst.st_size)
+		RET(0);
+	if ((rv = fdcmp(cfd, fd)) < 0)
+		perrnand(RET(-1), "read: %s", fnm);
+	RET(!rv);
+befret:
+	if (close(cfd) < 0)
+		perrnand(rv = -1, "close: %s", fnm);
+	return rv;
+}
+
 int
 execdof(struct dofile *df, FPARS(int, lvl, depfd))
 {
 	struct stat st, pst;
 	pid_t cld;
-	int ws, fd1, a3fd, rv;
+	int ws, fd1, a3fd, same, rv;
 	int unlarg3, unlfd1f;
 	char *trg;
 
@@ -384,6 +512,7 @@ execdof(struct dofile *df, FPARS(int, lvl, depfd))
 	} else
 		pst.st_size = 0;
 
+	prog.nexec++;
 	if ((cld = fork()) < 0)
 		perrnand(RET(DOFERR), "fork");
 	else if (!cld) {
@@ -450,6 +579,20 @@ execdof(struct dofile *df, FPARS(int, lvl, depfd))
 	if (!trg)
 		RET(TRGSAME);
 
+	/* keep $1 as it is when it would be replaced by the same contents,
+	   so that what depends on it stays up-to-date */
+	if (prog.cutoff && pst.st_size >= 0) {
+		if ((same = samecont(df->arg1, trg == df->arg3 ? a3fd : fd1)) < 0)
+			RET(DOFERR);
+		if (same) {
+			if (trg == df->arg3)
+				unlarg3 = 1;
+			else
+				unlfd1f = 1;
+			RET(TRGSAME);
+		}
+	}
+
 	/* fsync the target, rename, fsync target's directory */
 	if (prog.fsync) {
 		if (trg == df->arg3) {
@@ -516,18 +659,29 @@ repdep(int depfd, char t, const char *depfnm)
 	return 1;
 }
 
+/* fill rec for the dependency fnm of trg, appending its path to sf */
 int
-fputdep(FILE *f, int t, FPARS(const char, *fnm, *trg))
+fputdep(struct birec *rec, FILE *sf, int t, FPARS(const char, *fnm, *trg))
 {
 	struct stat st;
+	uint32_t len;
+	off_t off;
 	char rlp[PATH_MAX], tdir[PATH_MAX];
 
-	fputc(t, f);
+	memset(rec, 0, sizeof *rec);
+	rec->type = t;
 	if (t != '-') {
 		if (stat(fnm, &st) < 0)
 			perrnand(return 0, "stat: %s", fnm);
-		fwrite(&st.st_ino, sizeof st.st_ino, 1, f);
-		fwrite(&st.st_mtim, sizeof st.st_mtim, 1, f);
+		if (prog.hash && t == '=' && S_ISREG(st.st_mode)) {
+			if (fhash(AT_FDCWD, fnm, &st, &rec->hash) < 0)
+				return 0;
+			rec->size = st.st_size;
+			rec->hashed = 1;
+		}
+		rec->ino = st.st_ino;
+		rec->sec = st.st_mtim.tv_sec;
+		rec->nsec = st.st_mtim.tv_nsec;
 	} else {
 		if (access(fnm, F_OK) < 0) {
 			if (errno != ENOENT)
@@ -541,47 +695,259 @@ fputdep(FILE *f, int t, FPARS(const char, *fnm, *trg))
 	if (!relpath(rlp, sizeof rlp, fnm, tdir))
 		perrnand(return 0, "%s", strerror(ENAMETOOLONG));
 
-	fputs(rlp, f);
-	fwrite("", 1, 1, f);
-	return !ferror(f);
+	if ((off = ftello(sf)) < 0)
+		perrnand(return 0, "ftello");
+	rec->fnmoff = off;
+	len = strlen(rlp);
+	fwrite(&len, sizeof len, 1, sf);
+	fwrite(rlp, 1, len + 1, sf);
+	return !ferror(sf);
 }
 
 int
-recdeps(FPARS(const char, *bifnm, *rdfnm, *trg))
+recdeps(FPARS(const char, *rdfnm, *trg))
 {
-	FILE *rf, *wf;
-	size_t i;
+	FILE *rf, *sf;
+	struct bihdr hdr;
+	struct birec *recv;
+	size_t i, depc, depn, strsz, len;
 	int c, rv;
+	char *strs, *buf;
 	char depln[PATH_MAX+1]; /* type, PATH */
-	char wrfnm[PATH_MAX];
 
-	rf = wf = NULL;
-	sprintf(wrfnm, "%s.t", bifnm); /* write to a temporary file at first */
+	rf = sf = NULL, strs = buf = NULL, recv = NULL, depc = depn = 0;
 	if (!(rf = fopen(rdfnm, "r")))
 		perrnand(RET(0), "fopen: %s", rdfnm);
-	if (!(wf = fopen(wrfnm, "w")))
-		perrnand(RET(0), "fopen: %s", wrfnm);
+	if (!(sf = open_memstream(&strs, &strsz)))
+		perrnand(RET(0), "open_memstream");
 
-	if (filelck(fileno(wf), F_SETLKW, F_WRLCK, 0, 0) < 0)
-		perrnand(RET(0), "filelck: %s", wrfnm);
-	if (!fputdep(wf, ':', trg, trg))
-		RET(0);
-	i = 0;
-	while ((c = fgetc(rf)) != EOF) {
-		if (!(depln[i++] = c)) {
-			if (!fputdep(wf, depln[0], depln+1, trg))
-				RET(0);
-			i = 0;
-			continue;
-		}
-		if (i >= sizeof depln)
+	depln[0] = ':';
+	strcpy(depln+1, trg);
+	do {
+		if (depc == depn && !(recv = realloc(recv,
+		(depn = depn ? 2*depn : 16) * sizeof *recv)))
+			perrnand(RET(0), "malloc");
+		if (!fputdep(&recv[depc++], sf, depln[0], depln+1, trg))
 			RET(0);
-	}
+		i = 0;
+		while ((c = fgetc(rf)) != EOF && (depln[i++] = c))
+			if (i >= sizeof depln)
+				RET(0);
+	} while (c != EOF);
 	if (!feof(rf))
 		RET(0);
+	c = fclose(sf);
+	sf = NULL;
+	if (c)
+		perrnand(RET(0), "fclose");
+
+	hdr = (struct bihdr){
+		.ver = BIVER,
+		.hdrsz = sizeof hdr,
+		.depc = depc,
+		.recsz = sizeof *recv,
+		.stroff = sizeof hdr + depc * sizeof *recv,
+	};
+	memcpy(hdr.magic, bimagic, sizeof hdr.magic);
+	len = hdr.stroff + strsz;
+	if (!(buf = malloc(len)))
+		perrnand(RET(0), "malloc");
+	memcpy(buf, &hdr, sizeof hdr);
+	memcpy(buf + sizeof hdr, recv, depc * sizeof *recv);
+	memcpy(buf + hdr.stroff, strs, strsz);
+	RET(writebi(trg, buf, len, NULL));
+befret:
+	if (rf && fclose(rf))
+		perrnand(rv = 0, "fclose: %s", rdfnm);
+	if (sf && fclose(sf))
+		perrnand(rv = 0, "fclose");
+	free(strs);
+	free(recv);
+	free(buf);
+	return rv;
+}
+
+/* recognize the format of the build info in bi->buf and start parsing it
+   invalid build info has no dependencies for bigetdep */
+void
+biinit(struct bi *bi)
+{
+	struct bihdr hdr;
+
+	bi->ver = 1, bi->off = 0, bi->end = bi->len;
+	if (bi->len < sizeof hdr || memcmp(bi->buf, bimagic, sizeof bimagic))
+		return;
+	memcpy(&hdr, bi->buf, sizeof hdr);
+	bi->ver = bi->end = 0;
+	if (hdr.ver != BIVER || hdr.hdrsz < sizeof hdr ||
+	hdr.recsz < sizeof (struct birec) ||
+	hdr.stroff < hdr.hdrsz || hdr.stroff > bi->len ||
+	(hdr.stroff - hdr.hdrsz) / hdr.recsz < hdr.depc)
+		return;
+	bi->ver = hdr.ver;
+	bi->off = hdr.hdrsz;
+	bi->end = hdr.hdrsz + (size_t)hdr.depc * hdr.recsz;
+	bi->recsz = hdr.recsz;
+	bi->stroff = hdr.stroff;
+}
+
+void
+bifree(struct bi *bi)
+{
+	switch (bi->mem) {
+	case BIMALLOC:
+		free(bi->buf);
+		break;
+	case BIMMAP:
+		munmap(bi->buf, bi->len);
+	}
+	bi->buf = NULL, bi->mem = BIMALLOC;
+}
+
+/* read the build info of trg in bi->buf, which the caller frees
+   errno is ENOENT when there is none */
+int
+readbi(struct bi *bi, const char *trg)
+{
+	struct stat st;
+	int fd, errnsv;
+	char bifnm[PATH_MAX];
+
+	bi->buf = NULL, bi->len = 0, bi->mem = BIMALLOC, bi->dboff = -1;
+	if (prog.srv && !prog.db)
+		return readbicache(bi, trg);
+	if (prog.db)
+		switch (dbget(trg, &bi->buf, &bi->len, &bi->dboff)) {
+		case -1:
+			return -1;
+		case 1:
+			biinit(bi);
+			return 0;
+		}
+
+	if ((fd = open(getbifnm(bifnm, trg), O_RDONLY|O_CLOEXEC)) < 0)
+		return -1;
+	if (filelck(fd, F_SETLKW, F_RDLCK, 0, 0) < 0 || fstat(fd, &st) < 0)
+		goto err;
+	/* private, so that bisetst can modify it */
+	if (st.st_size) {
+		bi->buf = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE, fd, 0);
+		if (bi->buf == MAP_FAILED) {
+			bi->buf = NULL;
+			goto err;
+		}
+		bi->mem = BIMMAP;
+	}
+	bi->len = st.st_size;
+	bi->ino = st.st_ino;
+	bi->mtim = st.st_mtim;
+	if (close(fd) < 0) {
+		fd = -1;
+		goto err;
+	}
+	/* migrate the build-info file to the database */
+	if (prog.db && dbput(trg, bi->buf, bi->len, -1, &bi->dboff) < 0) {
+		fd = -1;
+		goto err;
+	}
+	biinit(bi);
+	return 0;
+err:
+	errnsv = errno;
+	bifree(bi);
+	if (fd >= 0)
+		close(fd);
+	errno = errnsv;
+	return -1;
+}
+
+/* readbi for the server: the build info of trg is read once,
+   and then as long as its build-info file doesn't get replaced,
+   bi->buf is the copy in the cache */
+int
+readbicache(struct bi *bi, const char *trg)
+{
+	struct stat st;
+	struct bcent *e, **b;
+	int fd, errnsv;
+	char bifnm[PATH_MAX];
+
+	b = &bcache[hash64(trg, strlen(trg), HASHINIT) & (BCACHESZ-1)];
+	for (e = *b; e && strcmp(e->trg, trg); e = e->next)
+		;
+	if (stat(getbifnm(bifnm, trg), &st) < 0)
+		return -1;
+	if (!e || e->ino != st.st_ino || !TSEQ(e->mtim, st.st_mtim) ||
+	e->size != st.st_size) {
+		if (!e) {
+			if (!(e = calloc(1, sizeof *e)) ||
+			!(e->trg = strdup(trg))) {
+				free(e);
+				return -1;
+			}
+			e->next = *b, *b = e;
+		}
+		free(e->buf), e->buf = NULL, e->size = -1;
+		if ((fd = open(bifnm, O_RDONLY|O_CLOEXEC)) < 0)
+			return -1;
+		if (filelck(fd, F_SETLKW, F_RDLCK, 0, 0) < 0 ||
+		fstat(fd, &st) < 0 ||
+		!(e->buf = malloc(st.st_size ? st.st_size : 1)) ||
+		(st.st_size && doread(fd, e->buf, st.st_size) < 0)) {
+			errnsv = errno;
+			close(fd);
+			errno = errnsv;
+			return -1;
+		}
+		if (close(fd) < 0)
+			return -1;
+		e->ino = st.st_ino;
+		e->mtim = st.st_mtim;
+		e->size = st.st_size;
+		e->len = st.st_size;
+	}
+	bi->buf = e->buf;
+	bi->len = e->len;
+	bi->mem = BICACHE;
+	bi->ino = e->ino;
+	bi->mtim = e->mtim;
+	biinit(bi);
+	return 0;
+}
+
+/* store buf as the build info of trg,
+   unless old is given and what it was read from was replaced since */
+int
+writebi(const char *trg, const char *buf, size_t len, const struct bi *old)
+{
+	struct stat st;
+	int fd, rv;
+	char bifnm[PATH_MAX], wrfnm[PATH_MAX];
+
+	if (prog.db) {
+		if (dbput(trg, buf, len, old ? old->dboff : DBANY, NULL) < 0)
+			perrnand(return 0, "dbput: %s", trg);
+		return 1;
+	}
+
+	/* write to a temporary file at first */
+	sprintf(wrfnm, "%s.t", getbifnm(bifnm, trg));
+	if ((fd = open(wrfnm, O_WRONLY|O_CREAT|O_CLOEXEC, prog.fmode)) < 0)
+		perrnand(return 0, "open: %s", wrfnm);
+	if (filelck(fd, F_SETLKW, F_WRLCK, 0, 0) < 0)
+		perrnand(RET(0), "filelck: %s", wrfnm);
+	if (old) {
+		if (stat(bifnm, &st) < 0)
+			perrnand(RET(0), "stat: %s", bifnm);
+		if (st.st_ino != old->ino || !TSEQ(st.st_mtim, old->mtim))
+			RET(1);
+	}
+	if (ftruncate(fd, 0) < 0 || dowrite(fd, buf, len) < 0)
+		perrnand(RET(0), "write: %s", wrfnm);
 
 	/* fsync bifile, rename, fsync directory */
-	if (prog.fsync && fsync(fileno(wf)) < 0)
+	if (prog.fsync && fsync(fd) < 0)
 		perrnand(RET(0), "fsync: %s", wrfnm);
 	if (rename(wrfnm, bifnm) < 0)
 		perrnand(RET(0), "rename: %s -> %s", wrfnm, bifnm);
@@ -592,62 +958,273 @@ recdeps(FPARS(const char, *bifnm, *rdfnm, *trg))
 		);
 	RET(1);
 befret:
-	if (rf && fclose(rf))
-		perrnand(rv = 0, "fclose: %s", rdfnm);
-	if (wf && fclose(wf))
-		perrnand(rv = 0, "fclose: %s", wrfnm);
+	if (close(fd) < 0)
+		perrnand(rv = 0, "close: %s", wrfnm);
 	return rv;
 }
 
-/* return 0 when file is invalid */
+/* parse the next dependency of bi, dep->fnm points in bi->buf
+   return 0 when file is invalid */
 int
-fgetdep(FILE *f, struct dep *dep)
+bigetdep(struct bi *bi, struct dep *dep)
 {
-	size_t i;
-	int t, c;
+	struct birec rec;
+	uint32_t len;
+	size_t strsz;
+	const char *p, *e, *z;
 
-	switch (t = fgetc(f)) {
+	if (bi->off >= bi->end)
+		return 0;
+	if (bi->ver == BIVER) {
+		memcpy(&rec, bi->buf + bi->off, sizeof rec);
+		strsz = bi->len - bi->stroff;
+		if (rec.fnmoff > strsz || strsz - rec.fnmoff <= sizeof len)
+			return 0;
+		p = bi->buf + bi->stroff + rec.fnmoff;
+		memcpy(&len, p, sizeof len);
+		p += sizeof len;
+		if (len >= strsz - rec.fnmoff - sizeof len || p[len])
+			return 0;
+		switch (rec.type) {
+		case ':':
+		case '=':
+		case '-':
+			break;
+		default:
+			return 0;
+		}
+		dep->type = rec.type;
+		dep->ino = rec.ino;
+		dep->mtim.tv_sec = rec.sec;
+		dep->mtim.tv_nsec = rec.nsec;
+		dep->hashed = rec.hashed;
+		dep->size = rec.size;
+		dep->hash = rec.hash;
+		dep->refr = 0;
+		dep->stoff = bi->off;
+		dep->fnm = p;
+		bi->off += bi->recsz;
+		return 1;
+	}
+
+	p = bi->buf + bi->off, e = bi->buf + bi->end;
+	dep->refr = dep->hashed = 0;
+	if (*p == '#') { /* the contents of the following dependency */
+		if (e - ++p < sizeof dep->size + sizeof dep->hash + 1)
+			return 0;
+		memcpy(&dep->size, p, sizeof dep->size);
+		p += sizeof dep->size;
+		memcpy(&dep->hash, p, sizeof dep->hash);
+		p += sizeof dep->hash;
+		if (*p != '=')
+			return 0;
+		dep->hashed = 1;
+	}
+	switch (dep->type = *p++) {
 	case ':':
 	case '=':
+		if (e - p < sizeof dep->ino + sizeof dep->mtim)
+			return 0;
+		dep->stoff = p - bi->buf;
+		memcpy(&dep->ino, p, sizeof dep->ino);
+		p += sizeof dep->ino;
+		memcpy(&dep->mtim, p, sizeof dep->mtim);
+		p += sizeof dep->mtim;
 	case '-':
 		break;
 	default:
 		return 0;
 	}
-	if ((dep->type = t) != '-')
-		if (fread(&dep->ino, sizeof dep->ino, 1, f) != 1 ||
-		fread(&dep->mtim, sizeof dep->mtim, 1, f) != 1)
-			return 0;
-	i = 0;
-	while ((c = fgetc(f)) != EOF) {
-		if (!(dep->fnm[i++] = c))
-			break;
-		if (i >= sizeof dep->fnm)
-			return 0;
+	if (!(z = memchr(p, '\0', e - p)))
+		return 0;
+	dep->fnm = p;
+	bi->off = z + 1 - bi->buf;
+	return 1;
+}
+
+/* store dep's (refreshed) ino and mtim back in bi */
+void
+bisetst(struct bi *bi, const struct dep *dep)
+{
+	struct birec rec;
+	char *p;
+
+	p = bi->buf + dep->stoff;
+	if (bi->ver == BIVER) {
+		memcpy(&rec, p, sizeof rec);
+		rec.ino = dep->ino;
+		rec.sec = dep->mtim.tv_sec;
+		rec.nsec = dep->mtim.tv_nsec;
+		memcpy(p, &rec, sizeof rec);
+	} else {
+		memcpy(p, &dep->ino, sizeof dep->ino);
+		memcpy(p + sizeof dep->ino, &dep->mtim, sizeof dep->mtim);
 	}
-	if (!i || ferror(f))
+}
+
+/* hash the contents of fnm, relative to dirfd, whose status is st
+   the hashes are cached as long as (ino, mtime, size) stay the same */
+int
+fhash(int dirfd, const char *fnm, const struct stat *st, uint64_t *h)
+{
+	struct stat fst;
+	struct hcent *e;
+	int fd, rv;
+
+	e = &hcache[(st->st_ino ^ st->st_dev) & (HCACHESZ-1)];
+	if (e->dev == st->st_dev && e->ino == st->st_ino &&
+	TSEQ(e->mtim, st->st_mtim) && e->size == st->st_size) {
+		*h = e->hash;
 		return 0;
+	}
+	if ((fd = openat(dirfd, fnm, O_RDONLY|O_CLOEXEC)) < 0)
+		perrnand(return -1, "open: %s", fnm);
+	if (fstat(fd, &fst) < 0)
+		perrnand(RET(-1), "fstat: %s", fnm);
+	if (fst.st_ino != st->st_ino || !TSEQ(fst.st_mtim, st->st_mtim) ||
+	fst.st_size != st->st_size)
+		perrfand(RET(-1), "%s: modified while being hashed", fnm);
+	if (hashfd(fd, h) < 0)
+		perrnand(RET(-1), "read: %s", fnm);
+	*e = (struct hcent){
+		.dev = st->st_dev,
+		.ino = st->st_ino,
+		.mtim = st->st_mtim,
+		.size = st->st_size,
+		.hash = *h,
+	};
+	RET(0);
+befret:
+	if (close(fd) < 0)
+		perrnand(rv = -1, "close: %s", fnm);
+	return rv;
+}
+
+/* stat the dependencies left in bi at once, when they are enough
+   ds->n is the number of them that got stated */
+int
+bistatv(struct bi *bi, int tdirfd, struct depstv *ds)
+{
+	struct dep dep;
+	size_t off, n;
+	const char **fnmv;
+
+	*ds = (struct depstv){ 0 };
+	off = bi->off, n = 0, fnmv = NULL;
+	while (bi->off < bi->end && bigetdep(bi, &dep)) {
+		if (!(n & (n-1)) && !(fnmv = realloc(fnmv,
+		(n ? 2*n : 1) * sizeof *fnmv)))
+			perrnand(goto err, "malloc");
+		fnmv[n++] = dep.fnm;
+	}
+	bi->off = off;
+	if (n < STATBATCH) {
+		free(fnmv);
+		return 1;
+	}
+	if (!(ds->stv = malloc(n * sizeof *ds->stv)) ||
+	!(ds->errv = malloc(n * sizeof *ds->errv)))
+		perrnand(goto err, "malloc");
+	fstatatv(tdirfd, fnmv, ds->stv, ds->errv, n);
+	ds->n = n;
+	free(fnmv);
 	return 1;
+err:
+	bi->off = off;
+	free(fnmv);
+	free(ds->stv);
+	free(ds->errv);
+	return 0;
 }
 
+/* pst is dep's status (perr the errno of stating it) if known, or NULL */
 int
-depchanged(struct dep *dep, int tdirfd)
+depchanged(struct dep *dep, int tdirfd, const struct stat *pst, int perr)
 {
 	struct stat st;
+	uint64_t h;
+	int err;
+
+	if (pst)
+		st = *pst, err = perr;
+	else
+		err = fstatat(tdirfd, dep->fnm, &st, 0) < 0 ? errno : 0;
 
 	switch (dep->type) {
 	case ':':
 	case '=':
-		if (!fstatat(tdirfd, dep->fnm, &st, 0) &&
-		dep->ino == st.st_ino && TSEQ(dep->mtim, st.st_mtim))
-			return 0;
+		if (!err) {
+			if (dep->ino == st.st_ino && TSEQ(dep->mtim, st.st_mtim))
+				return 0;
+			/* e.g. touched or checked out again */
+			if (dep->hashed && S_ISREG(st.st_mode) &&
+			st.st_size == dep->size &&
+			!fhash(tdirfd, dep->fnm, &st, &h) && h == dep->hash) {
+				dep->ino = st.st_ino;
+				dep->mtim = st.st_mtim;
+				dep->refr = 1;
+				return 0;
+			}
+		}
 	case '-':
-		if (faccessat(tdirfd, dep->fnm, F_OK, 0))
+		if (err)
 			return 0;
 	}
 	return 1;
 }
 
+/* open dir, or reuse its fd if cached and dir wasn't removed since
+   fds from diropen are only closed with dirclose */
+int
+diropen(const char *dir)
+{
+	struct stat st;
+	struct dcent *e, *fr;
+	int fd;
+
+	fr = NULL;
+	for (e = dcache; e < dcache + DCACHESZ; e++) {
+		if (!*e->pth || strcmp(e->pth, dir)) {
+			if (!e->refs && (!fr || !*e->pth))
+				fr = e;
+			continue;
+		}
+		if (!fstat(e->fd, &st) && st.st_nlink) {
+			e->refs++;
+			return e->fd;
+		}
+		if (!e->refs) {
+			close(e->fd);
+			*e->pth = '\0';
+			fr = e;
+		}
+		break;
+	}
+	if ((fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0)
+		return -1;
+	if (fr && strlen(dir) < sizeof fr->pth) {
+		if (*fr->pth)
+			close(fr->fd);
+		strcpy(fr->pth, dir);
+		fr->fd = fd;
+		fr->refs = 1;
+	}
+	return fd;
+}
+
+int
+dirclose(int fd)
+{
+	struct dcent *e;
+
+	for (e = dcache; e < dcache + DCACHESZ; e++)
+		if (e->fd == fd && e->refs) {
+			e->refs--;
+			return 0;
+		}
+	return close(fd);
+}
+
 void
 pstatln(FPARS(int, ok, lvl), FPARS(const char, *trg, *dfpth))
 {
@@ -767,10 +1344,13 @@ redo(char *trg, FPARS(int, lvl, pdepfd))
 	if (!access(trg, F_OK)) {
 		if (pdepfd >= 0 && !repdep(pdepfd, '=', trg))
 			RET(0);
-		if (!recdeps(getbifnm(tmp, trg), tmpdepfnm, trg))
+		if (!recdeps(tmpdepfnm, trg))
 			RET(0);
+		rtset(trg, RTOK);
 	} else if (errno != ENOENT)
 		perrnand(RET(0), "access: %s", trg);
+	else
+		rtset(trg, RTNOTRG);
 	RET(1);
 ifchange:
 	ifch = 1, rv = 0;
@@ -792,16 +1372,80 @@ befret:
 	return rv;
 }
 
+/* bring the ifchange dependencies left in bi up to date in parallel,
+   in a child, the way vjredo does with its targets
+   *done is set when that was worth it and succeeded */
+int
+pifchange(struct bi *bi, const char *tdir, FPARS(int, lvl, *done))
+{
+	struct dep dep;
+	size_t off;
+	pid_t cld;
+	int depc, st, i, rv;
+	char **depv;
+	char depfnm[PATH_MAX];
+
+	*done = 0, depc = 0, depv = NULL, off = bi->off;
+	while (bi->off < bi->end && bigetdep(bi, &dep)) {
+		if (dep.type != '=')
+			continue;
+		if (!normpath(depfnm, sizeof depfnm - PTHMAXSUF, dep.fnm, tdir)) {
+			errno = ENAMETOOLONG;
+			perrfand(RET(0), "%s", dep.fnm);
+		}
+		if (!(depv = realloc(depv, (depc+1) * sizeof *depv)) ||
+		!(depv[depc] = strdup(depfnm)))
+			perrnand(RET(0), "malloc");
+		depc++;
+	}
+	if (depc < 2)
+		RET(1);
+
+	if ((cld = fork()) < 0)
+		perrnand(RET(0), "fork");
+	else if (!cld) {
+		prog.lvl = lvl;
+		prog.pdepfd = -1;
+		prog.pid = getpid();
+		vjredo(&redoifchange, depc, depv);
+		exit(0);
+	}
+	if (waitpid(cld, &st, 0) < 0)
+		perrnand(RET(0), "waitpid");
+	if (!WIFEXITED(st) || WEXITSTATUS(st))
+		RET(0);
+	*done = 1;
+	RET(1);
+befret:
+	for (i = 0; i < depc; i++)
+		free(depv[i]);
+	free(depv);
+	bi->off = off;
+	return rv;
+}
+
 int
 redoifchange(char *trg, FPARS(int, lvl, pdepfd))
 {
-	FILE *bif; /* build info file */
+	struct bi bi; /* build info */
 	struct dep dep;
+	struct depstv ds;
+	unsigned long nexec;
+	size_t i;
 	int tdirfd;
-	int rb, c, rv;
-	char tdir[PATH_MAX], bifnm[PATH_MAX], depfnm[PATH_MAX];
-
-	rb = 0, tdirfd = -1, bif = NULL;
+	int rb, pard, refr, rv;
+	char tdir[PATH_MAX], depfnm[PATH_MAX];
+
+	rb = 0, tdirfd = -1, bi.buf = NULL, bi.mem = BIMALLOC;
+	ds = (struct depstv){ 0 };
+	/* already checked or built during this run */
+	switch (rtget(trg)) {
+	case RTOK:
+		if (pdepfd >= 0 && !repdep(pdepfd, '=', trg))
+			RET(0);
+	case RTNOTRG:
+		RET(1);
+	}
 	/* target doesn't exist */
 	if (access(trg, F_OK))
 		goto rebuild;
@@ -809,32 +1453,36 @@ redoifchange(char *trg, FPARS(int, lvl, pdepfd))
 	DIRFROMPATH(dir, trg,
 		strcpy(tdir, dir);
 	);
-	if ((tdirfd = open(tdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0)
+	if ((tdirfd = diropen(tdir)) < 0)
 		perrnand(RET(0), "open: %s", tdir);
 
-	/* when trg exists but build info in .redo/ doesn't,
+	/* when trg exists but its build info doesn't,
 	   assume trg in not supposed to been build by redo */
-	if (access(getbifnm(bifnm, trg), F_OK)) {
+	if (readbi(&bi, trg) < 0) {
+		if (errno != ENOENT)
+			perrnand(RET(0), "readbi: %s", trg);
 		if (pdepfd >= 0 && !repdep(pdepfd, '=', trg))
 			RET(0);
+		rtset(trg, RTOK);
 		RET(1);
 	}
 
-	if (!(bif = fopen(bifnm, "r")))
-		perrnand(RET(0), "fopen: %s", bifnm);
-	if (filelck(fileno(bif), F_SETLKW, F_RDLCK, 0, 0) < 0)
-		perrnand(RET(0), "filelck: %s", bifnm);
-
-	if (!fgetdep(bif, &dep) || dep.type != ':')
+	if (!bigetdep(&bi, &dep) || dep.type != ':')
 		goto rebuild;
-	if (depchanged(&dep, tdirfd))
+	if (depchanged(&dep, tdirfd, NULL, 0))
 		perrfand(RET(0), "aborting: %s was externally modified",
 			dep.fnm);
-	while ((c = fgetc(bif)) != EOF) {
-		ungetc(c, bif);
-		if (!fgetdep(bif, &dep))
+	pard = refr = 0;
+	if (prog.withjm && !pifchange(&bi, tdir, lvl+1, &pard))
+		RET(0);
+	/* valid until a .do file gets executed */
+	if (!bistatv(&bi, tdirfd, &ds))
+		RET(0);
+	nexec = prog.nexec;
+	for (i = 0; bi.off < bi.end; i++) {
+		if (!bigetdep(&bi, &dep))
 			goto rebuild;
-		if (dep.type == '=') {
+		if (dep.type == '=' && !pard) {
 			if (!normpath(depfnm, sizeof depfnm - PTHMAXSUF,
 			dep.fnm, tdir)) {
 				errno = ENAMETOOLONG;
@@ -843,19 +1491,30 @@ redoifchange(char *trg, FPARS(int, lvl, pdepfd))
 			if (!redoifchange(depfnm, lvl+1, -1))
 				RET(0);
 		}
-		if (depchanged(&dep, tdirfd))
+		if (i < ds.n && nexec == prog.nexec ?
+		depchanged(&dep, tdirfd, &ds.stv[i], ds.errv[i]) :
+		depchanged(&dep, tdirfd, NULL, 0))
 			goto rebuild;
+		if (dep.refr) {
+			bisetst(&bi, &dep);
+			refr = 1;
+		}
 	}
+	/* so that the contents don't have to be hashed again */
+	if (refr && !writebi(trg, bi.buf, bi.len, &bi))
+		RET(0);
 	if (pdepfd >= 0 && !repdep(pdepfd, '=', trg))
 		perrnand(RET(0), "repdep: %s", trg);
+	rtset(trg, RTOK);
 	RET(1);
 rebuild:
-	rb = 1, rv = 0;
+	rb = !prog.srv, rv = 0;
 befret:
-	if (tdirfd >= 0 && close(tdirfd) < 0)
+	if (tdirfd >= 0 && dirclose(tdirfd) < 0)
 		perrnand(rv = 0, "close: %s", tdir);
-	if (bif && fclose(bif))
-		perrnand(rv = 0, "fclose: %s", bifnm);
+	free(ds.stv);
+	free(ds.errv);
+	bifree(&bi);
 	if (rb)
 		rv = redo(trg, lvl, pdepfd);
 	return rv;
@@ -872,44 +1531,37 @@ redoifcreate(char *trg, FPARS(int, lvl, pdepfd))
 int
 redoinfofor(char *trg, FPARS(int, lvl, pdepfd))
 {
-	FILE *bif;
+	struct bi bi;
 	struct dep dep;
-	int c, rv;
-	char bifnm[PATH_MAX];
+	int rv;
 
-	bif = NULL;
-	if (!(bif = fopen(getbifnm(bifnm, trg), "r"))) {
+	if (readbi(&bi, trg) < 0) {
 		if (errno != ENOENT)
-			perrnand(RET(0), "fopen: %s", bifnm);
+			perrnand(RET(0), "readbi: %s", trg);
 		char rlp[PATH_MAX];
 		printf("%s: not build by redo\n",
 			relpath(rlp, sizeof rlp, trg, prog.wd) ? rlp : trg);
 		RET(0);
 	}
 
-	if (filelck(fileno(bif), F_SETLKW, F_RDLCK, 0, 0) < 0)
-		perrnand(RET(0), "filelck: %s", bifnm);
 	do {
-		if (!fgetdep(bif, &dep))
+		if (!bigetdep(&bi, &dep))
 			goto invlf;
+		if (dep.hashed)
+			printf("# %jd %016" PRIx64 "\n", (intmax_t)dep.size,
+				dep.hash);
 		printf("%c ", (char)dep.type);
 		if (dep.type != '-')
 			printf("%ju %jd %jd ", (uintmax_t)dep.ino,
 				(intmax_t)dep.mtim.tv_sec,
 				(intmax_t)dep.mtim.tv_nsec);
 		printf("%s\n", dep.fnm);
-		if ((c = fgetc(bif)) == EOF)
-			break;
-		ungetc(c, bif);
-	} while (1);
-	if (ferror(bif))
-		perrnand(RET(0), "ferror: %s", bifnm);
+	} while (bi.off < bi.end);
 	RET(1);
 invlf:
-	perrfand(RET(0), "%s: invalid build-info file", bifnm);
+	perrfand(RET(0), "%s: invalid build info", trg);
 befret:
-	if (bif && fclose(bif))
-		perrnand(rv = 0, "fclose: %s", bifnm);
+	bifree(&bi);
 	return rv;
 }
 
@@ -998,6 +1650,177 @@ vjredo(redofnt *redofn, int trgc, char *trgv[])
 		jredo(redofn, *trgv, &paral, trgc > 1);
 }
 
+/* the address of the server: $REDO_SERVER, or the default under wd */
+int
+srvaddr(struct sockaddr_un *sa, const char *wd, int *dflt)
+{
+	const char *e;
+	char dfpth[sizeof redir + sizeof srvsock], pth[PATH_MAX];
+
+	if ((*dflt = !(e = getenv(enm.server)) || !*e))
+		sprintf(dfpth, "%s/%s", redir, srvsock), e = dfpth;
+	if (!normpath(pth, sizeof pth, e, wd) ||
+	strlen(pth) >= sizeof sa->sun_path) {
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+	memset(sa, 0, sizeof *sa);
+	sa->sun_family = AF_UNIX;
+	strcpy(sa->sun_path, pth);
+	return 1;
+}
+
+/* what the answers of a server depend on, besides the files:
+   whether hashes are used and the database */
+int
+srvhdr(char *hdr, size_t n, const char *wd)
+{
+	const char *e;
+	char dbpth[PATH_MAX];
+
+	*dbpth = '\0';
+	if ((e = getenv(enm.db)) && *e && !normpath(dbpth, sizeof dbpth, e, wd))
+		return 0;
+	return snprintf(hdr, n, "%d %s", (int)envgeti(enm.hash, 0, 1, 0),
+		dbpth) < n;
+}
+
+/* ask the server, if any, whether the targets are up-to-date
+   return 1 when all of them are, after reporting them to the parent,
+   otherwise they are checked (and built) as without a server */
+int
+srvask(int trgc, char *trgv[])
+{
+	struct sockaddr_un sa;
+	FILE *f;
+	size_t len;
+	int fd, i, dflt, pdepfd, rv;
+	char *buf, *ans;
+	char wd[PATH_MAX], hdr[PATH_MAX+16], trg[PATH_MAX];
+
+	fd = -1, f = NULL, buf = ans = NULL;
+	if (!getcwd(wd, sizeof wd) || !srvaddr(&sa, wd, &dflt))
+		RET(0);
+	/* nested instances only use the server their top-level instance used */
+	if (dflt && getenv(enm.lvl))
+		RET(0);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 ||
+	connect(fd, (struct sockaddr *)&sa, sizeof sa) < 0)
+		RET(0);
+	if (dflt && envsets(enm.server, sa.sun_path) < 0)
+		RET(0);
+
+	if (!srvhdr(hdr, sizeof hdr, wd) || !(f = open_memstream(&buf, &len)))
+		RET(0);
+	fwrite(hdr, 1, strlen(hdr) + 1, f);
+	for (i = 0; i < trgc; i++) {
+		if (!normpath(trg, sizeof trg - PTHMAXSUF, trgv[i], wd))
+			RET(0);
+		fwrite(trg, 1, strlen(trg) + 1, f);
+	}
+	i = fclose(f);
+	f = NULL;
+	if (i || dowrite(fd, buf, len) < 0 || shutdown(fd, SHUT_WR) < 0)
+		RET(0);
+	if (!(ans = malloc(trgc)) || doread(fd, ans, trgc) < 0)
+		RET(0);
+	for (i = 0; i < trgc; i++)
+		if (ans[i] != 'y')
+			RET(0);
+
+	if ((pdepfd = envgetfd(enm.pdepfd)) >= 0)
+		for (i = 0; i < trgc; i++)
+			if (!normpath(trg, sizeof trg, trgv[i], wd) ||
+			!repdep(pdepfd, '=', trg))
+				exit(1);
+	RET(1);
+befret:
+	if (f)
+		fclose(f);
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	free(ans);
+	return rv;
+}
+
+/* answer the requests of a client: its header and then targets,
+   a 'y' or 'n' for each, for whether it is up-to-date */
+void
+srvconn(int fd, const char *hdr)
+{
+	FILE *f;
+	size_t n;
+	int ok;
+	char *ln, a;
+	char trg[PATH_MAX];
+
+	ln = NULL, n = 0;
+	if (!(f = fdopen(fd, "r"))) {
+		perrn("fdopen");
+		close(fd);
+		return;
+	}
+	/* the targets checked are remembered only during a connection */
+	rtfree();
+	if (rtcreat(prog.tmpffmt) < 0)
+		perrn("rtcreat");
+	ok = getdelim(&ln, &n, '\0', f) > 0 && !strcmp(ln, hdr);
+	while (getdelim(&ln, &n, '\0', f) > 0) {
+		a = ok && *ln == '/' && strlen(ln) < sizeof trg - PTHMAXSUF &&
+			redoifchange(strcpy(trg, ln), prog.lvl, -1) ? 'y' : 'n';
+		if (dowrite(fd, &a, 1) < 0)
+			break;
+	}
+	free(ln);
+	fclose(f);
+}
+
+/* serve the up-to-date checks of clients until interrupted */
+void
+srvrun(void)
+{
+	struct sockaddr_un sa;
+	struct sigaction sigact;
+	int fd, cfd, dflt;
+	char hdr[PATH_MAX+16];
+
+	if (!srvaddr(&sa, prog.wd, &dflt) || !srvhdr(hdr, sizeof hdr, prog.wd))
+		ferrn("%s", enm.server);
+	if (dflt)
+		DIRFROMPATH(dir, sa.sun_path,
+			if (mkpath(dir, prog.dmode) < 0)
+				ferrn("mkpath: %s", dir);
+		);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		ferrn("socket");
+	if (unlink(sa.sun_path) < 0 && errno != ENOENT)
+		ferrn("unlink: %s", sa.sun_path);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof sa) < 0)
+		ferrn("bind: %s", sa.sun_path);
+	if (listen(fd, SOMAXCONN) < 0)
+		ferrn("listen");
+
+	sigact = (struct sigaction){.sa_handler = SIG_IGN};
+	if (sigaction(SIGPIPE, &sigact, NULL) < 0)
+		ferrn("sigaction");
+	sigact.sa_handler = &onsig;
+	if (sigaction(SIGTERM, &sigact, NULL) < 0)
+		ferrn("sigaction");
+	prog.srv = 1;
+	prog.retonsig = 1; /* so that accept gets interrupted */
+	while (!gotsig && ((cfd = accept(fd, NULL, NULL)) >= 0 ||
+	errno != EINTR)) {
+		if (cfd < 0)
+			perrnand(continue, "accept");
+		srvconn(cfd, hdr);
+	}
+	if (unlink(sa.sun_path) < 0)
+		perrn("unlink: %s", sa.sun_path);
+	exit(0);
+}
+
 /* spawn job manager, non-jm child returns */
 void
 spawnjm(int jobsn)
@@ -1034,8 +1857,10 @@ spawnjm(int jobsn)
 void
 onsig(int sig)
 {
-	if (prog.retonsig)
+	if (prog.retonsig) {
+		gotsig = 1;
 		return;
+	}
 	_exit(1);
 }
 
@@ -1047,6 +1872,8 @@ setup(int jobsn)
 	const char *d;
 	char *e;
 	size_t n;
+	int fd;
+	char dbpth[PATH_MAX];
 
 	sa = (struct sigaction){.sa_handler = &onsig};
 	if (sigaction(SIGINT, &sa, NULL) < 0)
@@ -1097,24 +1924,45 @@ setup(int jobsn)
 		ferrf("$TMPDIR: %s", strerror(ENAMETOOLONG));
 
 	prog.fsync = envgeti(enm.fsync, 0, 1, 1);
+	prog.hash = envgeti(enm.hash, 0, 1, 0);
+	prog.cutoff = envgeti(enm.cutoff, 0, 1, 0);
+
+	/* every instance must use the same database, whatever its cwd */
+	if ((prog.db = (e = getenv(enm.db)) && *e)) {
+		if (!normpath(dbpth, sizeof dbpth, e, prog.wd))
+			ferrf("$%s: %s", enm.db, strerror(ENAMETOOLONG));
+		if (!prog.lvl && envsets(enm.db, dbpth) < 0)
+			ferrn("envsets");
+		if (dbopen(dbpth, prog.fmode, prog.fsync, !prog.lvl) < 0)
+			ferrn("dbopen: %s", dbpth);
+	}
+
+	/* the run table is only an optimization, so go on without it */
+	if (!prog.lvl) {
+		if ((fd = rtcreat(prog.tmpffmt)) < 0)
+			perrn("rtcreat");
+		else if (envseti(enm.runfd, fd) < 0)
+			ferrn("envseti");
+	} else if ((fd = envgetfd(enm.runfd)) >= 0 && rtinit(fd) < 0)
+		perrn("rtinit");
 }
 
 void
 usage(void)
 {
-	ferrf("usage: redo [-j n] targets...");
+	ferrf("usage: redo [-j n] targets... | redo -s");
 }
 
 int
 main(int argc, char *argv[])
 {
 	redofnt *redofn;
-	int jobsn;
+	int jobsn, srv;
 	char *s;
 
 	prognm = (s = strrchr(argv[0], '/')) ? s+1 : argv[0];
 
-	jobsn = 1;
+	jobsn = 1, srv = 0;
 	ARGBEGIN {
 	case 'j':
 		if (!(s = ARGF()))
@@ -1122,9 +1970,18 @@ main(int argc, char *argv[])
 		if ((jobsn = strtoint(s, 0, INT_MAX, -1)) < 0)
 			perrfand(usage(), "%s: Invalid number", s);
 		break;
+	case 's':
+		srv = 1;
+		break;
 	default:
 		perrfand(usage(), "-%c: Wrong option", ARGC());
 	} ARGEND
+	if (srv) {
+		if (argc || strcmp(prognm, "redo"))
+			usage();
+		setup(0);
+		srvrun();
+	}
 	if (!argc)
 		perrfand(usage(), "No targets given");
 
@@ -1139,6 +1996,8 @@ main(int argc, char *argv[])
 	else
 		ferrf("%s: not implemented", prognm);
 
+	if (redofn == &redoifchange && srvask(argc, argv))
+		return 0;
 	setup(jobsn - 1);
 	if (prog.withjm)
 		vjredo(redofn, argc, argv);
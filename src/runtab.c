@@ -0,0 +1,131 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "runtab.h"
+
+/* the run table is a hash table in a file that the top-level redo creates
+   and unlinks, shared through its fd by all redo instances of a run */
+#define RTSLOTS  (1 << 19) /* power of 2 */
+#define RTPROBES 64
+
+struct rtslot {
+	uint64_t hash; /* 0 for empty slots */
+	uint32_t len;
+	uint32_t st;
+};
+
+static struct rtslot *rt; /* NULL when the table is unavailable */
+static int rtfd = -1;
+
+/* return the slot of the key or the empty one it would take */
+intern struct rtslot *
+rtslot(uint64_t h, uint32_t len)
+{
+	size_t i, n;
+
+	for (i = h & (RTSLOTS-1), n = 0; n < RTPROBES;
+	i = (i+1) & (RTSLOTS-1), n++)
+		if (!rt[i].hash || (rt[i].hash == h && rt[i].len == len))
+			return &rt[i];
+	return NULL;
+}
+
+intern uint64_t
+rthash(const char *trg, size_t len)
+{
+	uint64_t h;
+
+	return (h = hash64(trg, len, HASHINIT)) ? h : 1;
+}
+
+/* create an anonymous run table in a file named like tmpffmt
+   return its fd */
+int
+rtcreat(const char *tmpffmt)
+{
+	int fd, errnsv;
+	char fnm[PATH_MAX];
+
+	if ((fd = mkstemp(strcpy(fnm, tmpffmt))) < 0)
+		return -1;
+	if (unlink(fnm) < 0 ||
+	ftruncate(fd, (off_t)RTSLOTS * sizeof *rt) < 0 ||
+	rtinit(fd) < 0) {
+		errnsv = errno;
+		close(fd);
+		errno = errnsv;
+		return -1;
+	}
+	return fd;
+}
+
+int
+rtinit(int fd)
+{
+	void *p;
+
+	p = mmap(NULL, RTSLOTS * sizeof *rt, PROT_READ|PROT_WRITE, MAP_SHARED,
+		fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	rt = p, rtfd = fd;
+	return 0;
+}
+
+/* forget the run table, e.g. to start another one */
+void
+rtfree(void)
+{
+	if (!rt)
+		return;
+	munmap(rt, RTSLOTS * sizeof *rt);
+	close(rtfd);
+	rt = NULL, rtfd = -1;
+}
+
+int
+rtget(const char *trg)
+{
+	struct rtslot *s;
+	size_t len;
+	uint64_t h;
+	int st;
+
+	if (!rt)
+		return RTNONE;
+	len = strlen(trg), h = rthash(trg, len);
+	if (filelck(rtfd, F_SETLKW, F_RDLCK, 0, 0) < 0)
+		return RTNONE;
+	st = (s = rtslot(h, len)) && s->hash ? s->st : RTNONE;
+	filelck(rtfd, F_SETLK, F_UNLCK, 0, 0);
+	return st;
+}
+
+/* best effort: nothing is recorded when the table is full */
+void
+rtset(const char *trg, int st)
+{
+	struct rtslot *s;
+	size_t len;
+	uint64_t h;
+
+	if (!rt)
+		return;
+	len = strlen(trg), h = rthash(trg, len);
+	if (filelck(rtfd, F_SETLKW, F_WRLCK, 0, 0) < 0)
+		return;
+	if ((s = rtslot(h, len))) {
+		s->st = st;
+		s->len = len;
+		s->hash = h;
+	}
+	filelck(rtfd, F_SETLK, F_UNLCK, 0, 0);
+}
@@ -0,0 +1,11 @@
+enum { /* states of a target in the run table */
+	RTNONE, /* not seen in this run */
+	RTOK, /* up-to-date, either checked or built */
+	RTNOTRG, /* built, but its .do file didn't create it */
+};
+
+int rtcreat(const char *tmpffmt);
+int rtinit(int fd);
+void rtfree(void);
+int rtget(const char *trg);
+void rtset(const char *trg, int st);
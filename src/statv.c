@@ -0,0 +1,68 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "statv.h"
+
+#define STATTHRMAX 8 /* threads used at most */
+#define STATPERTHR 8 /* files stated at least per thread */
+
+struct statjob {
+	int dirfd;
+	const char *const *fnmv;
+	struct stat *stv;
+	int *errv;
+	size_t i, n, step;
+};
+
+static void *
+statjob(void *arg)
+{
+	struct statjob *j = arg;
+	size_t i;
+
+	for (i = j->i; i < j->n; i += j->step)
+		j->errv[i] = fstatat(j->dirfd, j->fnmv[i], &j->stv[i], 0) < 0 ?
+			errno : 0;
+	return NULL;
+}
+
+/* fstatat() every fnmv[i] relative to dirfd into stv[i], with errv[i] set to
+   the errno of the failure or 0, using threads so that the latencies overlap
+   the threads are joined before returning */
+void
+fstatatv(int dirfd, const char *const fnmv[], struct stat stv[], int errv[],
+	size_t n)
+{
+	struct statjob jobv[STATTHRMAX];
+	pthread_t thrv[STATTHRMAX];
+	int throk[STATTHRMAX];
+	size_t i, thrn;
+
+	thrn = n / STATPERTHR;
+	if (thrn > STATTHRMAX)
+		thrn = STATTHRMAX;
+	if (thrn < 1)
+		thrn = 1;
+	for (i = 0; i < thrn; i++) {
+		jobv[i] = (struct statjob){
+			.dirfd = dirfd,
+			.fnmv = fnmv,
+			.stv = stv,
+			.errv = errv,
+			.i = i,
+			.n = n,
+			.step = thrn,
+		};
+		throk[i] = i && !pthread_create(&thrv[i], NULL, statjob, &jobv[i]);
+	}
+	/* the jobs for which no thread was created are done here */
+	for (i = 0; i < thrn; i++)
+		if (!throk[i])
+			statjob(&jobv[i]);
+	for (i = 1; i < thrn; i++)
+		if (throk[i])
+			pthread_join(thrv[i], NULL);
+}
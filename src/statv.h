@@ -0,0 +1,2 @@
+void fstatatv(int dirfd, const char *const fnmv[], struct stat stv[], int errv[],
+	size_t n);
@@ -3,6 +3,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include "util.h"
@@ -33,6 +35,37 @@ doread(int fd, void *buf, size_t n)
 	return n;
 }
 
+/* return the number of bytes written or -1 */
+ssize_t
+dopwrite(int fd, const void *buf, size_t n, off_t off)
+{
+	const char *p;
+	ssize_t w;
+	size_t l;
+
+	for (l = n, p = buf; l > 0; l -= w, p += w, off += w)
+		if ((w = pwrite(fd, p, l, off)) < 0)
+			return -1;
+	return n;
+}
+
+/* return the number of bytes read, less than n only at end of file, or -1 */
+ssize_t
+dopread(int fd, void *buf, size_t n, off_t off)
+{
+	char *p;
+	ssize_t r;
+	size_t l;
+
+	for (l = n, p = buf; l > 0; l -= r, p += r, off += r)
+		if ((r = pread(fd, p, l, off)) <= 0) {
+			if (r < 0)
+				return -1;
+			break;
+		}
+	return n - l;
+}
+
 size_t
 strlcpy(char *d, const char *s, size_t n)
 {
@@ -63,3 +96,70 @@ pthpcmp(FPARS(const char, *a, *b))
 
 	return l;
 }
+
+int
+filelck(FPARS(int, fd, cmd, type), FPARS(off_t, start, len))
+{
+	struct flock fl = {
+		.l_type = type,
+		.l_whence = SEEK_SET,
+		.l_start = start,
+		.l_len = len,
+	};
+	return fcntl(fd, cmd, &fl);
+}
+
+int
+dirsync(const char *dpth)
+{
+	int dirfd;
+
+	if ((dirfd = open(dpth, O_RDONLY|O_DIRECTORY)) < 0 ||
+	fsync(dirfd) < 0 || close(dirfd) < 0)
+		return -1;
+	return 0;
+}
+
+/* 64-bit FNV-1a */
+uint64_t
+hash64(const void *buf, size_t n, uint64_t h)
+{
+	const unsigned char *p;
+
+	for (p = buf; n > 0; n--, p++)
+		h = (h ^ *p) * UINT64_C(1099511628211);
+	return h;
+}
+
+/* hash what remains to be read from fd */
+int
+hashfd(int fd, uint64_t *h)
+{
+	ssize_t r;
+	char buf[BUFSIZ];
+
+	*h = HASHINIT;
+	while ((r = read(fd, buf, sizeof buf)) > 0)
+		*h = hash64(buf, r, *h);
+	return r < 0 ? -1 : 0;
+}
+
+/* compare the contents of two files
+   return 0 when they are the same, 1 when not and -1 on error */
+int
+fdcmp(FPARS(int, a, b))
+{
+	ssize_t ra, rb;
+	off_t off;
+	char bufa[BUFSIZ], bufb[BUFSIZ];
+
+	for (off = 0;; off += ra) {
+		if ((ra = pread(a, bufa, sizeof bufa, off)) < 0 ||
+		(rb = pread(b, bufb, sizeof bufb, off)) < 0)
+			return -1;
+		if (ra != rb || memcmp(bufa, bufb, ra))
+			return 1;
+		if (!ra)
+			return 0;
+	}
+}
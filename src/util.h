@@ -42,6 +42,8 @@
 
 #define intern static
 
+#define HASHINIT UINT64_C(14695981039346656037)
+
 #define PPCAT(A, B) A##B
 #define PPECAT(A, B) PPCAT(A, B)
 #define PPARG8(_0, _1, _2, _3, _4, _5, _6, _7, _8, ...) _8
@@ -67,6 +69,13 @@
 
 ssize_t dowrite(int fd, const void *buf, size_t n);
 ssize_t doread(int fd, void *buf, size_t n);
+ssize_t dopwrite(int fd, const void *buf, size_t n, off_t off);
+ssize_t dopread(int fd, void *buf, size_t n, off_t off);
 size_t strlcpy(char *dst, const char *src, size_t n);
 /* return a pointer to the first path component of a that b doesn't have */
 const char *pthpcmp(FPARS(const char, *a, *b));
+int filelck(FPARS(int, fd, cmd, type), FPARS(off_t, start, len));
+int dirsync(const char *dpth);
+uint64_t hash64(const void *buf, size_t n, uint64_t h);
+int hashfd(int fd, uint64_t *h);
+int fdcmp(FPARS(int, a, b));